@@ -20,25 +20,61 @@
 */
 
 #include <string>
+#include <exception>
 #include <memory>
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <utility>
 
 #if defined(_MSC_VER)
+#include <atomic>
 #include <ppl.h>
 #endif
 
-#include "VapourSynth.h"
-#include "VSHelper.h"
+#include "VapourSynth4.h"
+#include "VSHelper4.h"
 
 #define RGB_PIXEL_RANGE_EXTENDED 25501 // for 8bit RGB, 25501 = (256 - 1) * 100 + 1
+#define MAX_CACHED_PLANS 16 // distinct source sizes kept for variable resolution input
+#define GAMMA_INTERPOLATION_MIN 64 // below this gamma_LUT index, the curve is too steep to interpolate
+#define TILE_CACHE_BYTES (256 * 1024) // source block plus intermediate buffer of one tile, about one L2
 //#define DOUBLE_ROUND_MAGIC_NUMBER 6755399441055744.0
 
+// Everything that depends on the source frame size, computed once per distinct size.
+// num / den is the reduced dst / src ratio of each plane.
+struct AreaPlan
+{
+    int src_width, src_height;
+    bool process_plane[3];
+    int num_h[3], den_h[3];
+    int num_v[3], den_v[3];
+    int tile_width[3], tile_height[3];
+};
+
+// last_use is a tick of AreaData::plan_clock, for least recently used eviction
+struct CachedPlan
+{
+    std::shared_ptr<const AreaPlan> plan;
+    uint64_t last_use;
+};
+
 struct AreaData
 {
-    VSNodeRef* node;
+    VSNode* node;
     const VSVideoInfo* vi;
+    VSVideoFormat out_format;
     int target_width, target_height;
+    int matrix;
+    double kr, kb;
+    double gamma;
     double* linear_LUT;
     double* gamma_LUT;
+
+    mutable std::mutex plan_mutex;
+    mutable std::map<std::pair<int, int>, CachedPlan> plans;
+    mutable uint64_t plan_clock;
 };
 
 static int gcd(int x, int y)
@@ -47,37 +83,34 @@ static int gcd(int x, int y)
     return m == 0 ? y : gcd(y, m);
 }
 
+// Resize columns [dst_x, dst_x + dst_width) of src_height rows. srcp points to column 0
+// of the first row. dst_x may start inside a source pixel, so the counters start from
+// the part of that pixel left over by the previous column.
 template <typename T>
-static bool ResizeHorizontalPlanar(const VSFrameRef* src, VSFrameRef* dst, const T* srcp, T* VS_RESTRICT dstp,
-    int src_stride, int dst_stride, int plane, const VSAPI* vsapi) noexcept
+static bool ResizeHorizontalPlanar(const T* srcp, T* VS_RESTRICT dstp, int src_stride, int dst_stride,
+    int dst_x, int dst_width, int src_height, int num, int den) noexcept
 {
-    int gcd_h = gcd(vsapi->getFrameWidth(src, plane), vsapi->getFrameWidth(dst, plane));
-    int num = vsapi->getFrameWidth(dst, plane) / gcd_h;
-    int den = vsapi->getFrameWidth(src, plane) / gcd_h;
     double invert_den = 1.0 / (double)den;
 
-    int src_height = vsapi->getFrameHeight(src, plane);
-    int dst_width = vsapi->getFrameWidth(dst, plane);
+    const int64_t start = (int64_t)dst_x * den;
+    const int start_src = (int)(start / num);
+    const int start_num = num - (int)(start % num);
 
-#if defined(_MSC_VER)
-    Concurrency::parallel_for(0, (int)src_height, [&](int curPixel)
-#else
     for (int curPixel = 0; curPixel < src_height; curPixel++)
-#endif
     {
         const T* curSrcp = srcp + (src_stride * curPixel);  // same as "srcp += src_stride"
-        T* curBuff = dstp + (dst_width * curPixel);
+        T* curBuff = dstp + (dst_stride * curPixel);
 
-        unsigned short count_num = num;
-        int index_src = 0;
+        int count_num = start_num;
+        int index_src = start_src;
         for (unsigned int index_value = dst_width; index_value--; )
         {
             double pixel = 0.0;
-            unsigned short count_den = den;
+            int count_den = den;
             while (count_den > 0)
             {
-                short left = count_num - count_den;
-                unsigned short partial;
+                int left = count_num - count_den;
+                int partial;
                 if (left <= 0)
                 {
                     partial = count_num;
@@ -103,46 +136,36 @@ static bool ResizeHorizontalPlanar(const VSFrameRef* src, VSFrameRef* dst, const
             T pixelValue = (T)(pixel * invert_den);
             curBuff[index] = pixelValue;
         }
-#if defined(_MSC_VER)
-    });
-#else
     }
-#endif
 
     return true;
 }
 
+// Resize rows [dst_y, dst_y + dst_height) of dst_width columns. srcp points to the
+// source row containing the top of dst_y, which may be partially covered.
 template <typename T>
-static bool ResizeVerticalPlanar(const VSFrameRef* src, VSFrameRef* dst, const T* srcp, T* VS_RESTRICT dstp,
-    int src_stride, int dst_stride, int plane, const VSAPI* vsapi) noexcept
+static bool ResizeVerticalPlanar(const T* srcp, T* VS_RESTRICT dstp, int src_stride, int dst_stride,
+    int dst_y, int dst_width, int dst_height, int num, int den) noexcept
 {
-    int gcd_v = gcd(vsapi->getFrameHeight(src, plane), vsapi->getFrameHeight(dst, plane));
-    int num = vsapi->getFrameHeight(dst, plane) / gcd_v;
-    int den = vsapi->getFrameHeight(src, plane) / gcd_v;
     double invert_den = 1.0 / (double)den;
 
-    int dst_width = vsapi->getFrameWidth(dst, plane);
-    int dst_height = vsapi->getFrameHeight(dst, plane);
+    const int start_num = num - (int)((int64_t)dst_y * den % num);
 
-#if defined(_MSC_VER)
-    Concurrency::parallel_for(0, (int)dst_width, [&](int curPixel)
-#else
     for (int curPixel = 0; curPixel < dst_width; curPixel++)
-#endif
     {
         const T* curSrcp = srcp + curPixel;
         T* curDstp = dstp + curPixel;
 
-        unsigned short count_num = num;
+        int count_num = start_num;
         int index_src = 0;
         for (unsigned int index_value = dst_height; index_value--; )
         {
             double pixel = 0.0;
-            unsigned short count_den = den;
+            int count_den = den;
             while (count_den > 0)
             {
-                short left = count_num - count_den;
-                unsigned short partial;
+                int left = count_num - count_den;
+                int partial;
                 if (left <= 0)
                 {
                     partial = count_num;
@@ -168,30 +191,98 @@ static bool ResizeVerticalPlanar(const VSFrameRef* src, VSFrameRef* dst, const T
             T pixelValue = (T)(pixel * invert_den);
             curDstp[index] = pixelValue;
         }
+    }
+
+    return true;
+}
+
+// Resize one plane tile by tile. Each tile runs both passes through a small intermediate
+// buffer, so the source block, the buffer and the output block stay in cache. Source rows
+// partially covered by two vertically adjacent tiles are read by both. Returns false if
+// the intermediate buffer can't be allocated.
+template <typename T>
+static bool ResizePlanarTiled(const T* srcp, T* VS_RESTRICT dstp, int src_stride, int dst_stride,
+    int dst_width, int dst_height, int plane, const AreaPlan* plan) noexcept
+{
+    const int num_h = plan->num_h[plane];
+    const int den_h = plan->den_h[plane];
+    const int num_v = plan->num_v[plane];
+    const int den_v = plan->den_v[plane];
+    const int tile_width = plan->tile_width[plane];
+    const int tile_height = plan->tile_height[plane];
+
+    const int tiles_x = (dst_width + tile_width - 1) / tile_width;
+    const int tiles_y = (dst_height + tile_height - 1) / tile_height;
+
+    // a full tile touches at most one partially covered source row more at each end
+    const size_t buff_size = (size_t)tile_width * (size_t)((int64_t)tile_height * den_v / num_v + 2);
+
+    auto resize_tile = [&](int tile, T* buff)
+    {
+        const int x = (tile % tiles_x) * tile_width;
+        const int y = (tile / tiles_x) * tile_height;
+        const int width = std::min(tile_width, dst_width - x);
+        const int height = std::min(tile_height, dst_height - y);
+
+        // source rows touched by output rows [y, y + height)
+        const int src_y = (int)((int64_t)y * den_v / num_v);
+        const int src_y_end = (int)(((int64_t)(y + height) * den_v + num_v - 1) / num_v);
+        const int src_rows = src_y_end - src_y;
+
+        ResizeHorizontalPlanar<T>(srcp + src_stride * src_y, buff, src_stride, width, x, width, src_rows, num_h, den_h);
+        ResizeVerticalPlanar<T>((const T*)buff, dstp + dst_stride * y + x, width, dst_stride, y, width, height, num_v, den_v);
+    };
+
 #if defined(_MSC_VER)
+    // one buffer per worker thread, reused by every tile it runs
+    Concurrency::combinable<T*> buffs([]() -> T* { return nullptr; });
+    std::atomic<bool> allocated{ true };
+
+    Concurrency::parallel_for(0, tiles_x * tiles_y, [&](int tile)
+    {
+        T*& buff = buffs.local();
+        if (!buff)
+            buff = new (std::nothrow) T[buff_size];
+
+        if (buff)
+            resize_tile(tile, buff);
+        else
+            allocated = false;
     });
+
+    buffs.combine_each([](T* buff) { delete[] buff; });
+
+    return allocated;
 #else
-    }
-#endif
+    // without PPL, tiles run serially and intra-frame parallelism is left to
+    // the frame level threading of VapourSynth
+    T* buff = new (std::nothrow) T[buff_size];
+    if (!buff)
+        return false;
+
+    for (int tile = 0; tile < tiles_x * tiles_y; tile++)
+        resize_tile(tile, buff);
+
+    delete[] buff;
 
     return true;
+#endif
 }
 
 template <typename T>
-static bool ResizeHorizontalRGB(const VSFrameRef* src, VSFrameRef* dst, const T* srcp, T* VS_RESTRICT dstp,
-    int src_stride, int dst_stride, const AreaData* const VS_RESTRICT d, const VSAPI* vsapi) noexcept
+static bool ResizeHorizontalRGB(const T* srcp, T* VS_RESTRICT dstp,
+    int src_stride, int dst_stride, const AreaData* const VS_RESTRICT d, const AreaPlan* plan) noexcept
 {
-    int gcd_h = gcd(vsapi->getFrameWidth(src, 0), vsapi->getFrameWidth(dst, 0));
-    int num = vsapi->getFrameWidth(dst, 0) / gcd_h;
-    int den = vsapi->getFrameWidth(src, 0) / gcd_h;
+    int num = plan->num_h[0];
+    int den = plan->den_h[0];
 
-    int src_height = vsapi->getFrameHeight(src, 0);
-    int dst_width = vsapi->getFrameWidth(dst, 0);
+    int src_height = plan->src_height;
+    int dst_width = d->target_width;
 
     double scale;
-    if (d->vi->format->bytesPerSample == 1)
+    if (d->vi->format.bytesPerSample == 1)
         scale = 100.0;
-    else if (d->vi->format->bytesPerSample == 2)
+    else if (d->vi->format.bytesPerSample == 2)
         scale = 1.0;
 
     double invert_den_hun = scale / (double)den;
@@ -206,18 +297,18 @@ static bool ResizeHorizontalRGB(const VSFrameRef* src, VSFrameRef* dst, const T*
         const T* curSrcp = srcp + (src_stride * curPixel * ps);
         T* curBuff = dstp + (dst_width * curPixel * ps);
 
-        unsigned short count_num = num;
+        int count_num = num;
         int index_src = 0;
         for (unsigned int index_value = dst_width; index_value--; )
         {
             double blue = 0.0;
             double green = 0.0;
             double red = 0.0;
-            unsigned short count_den = den;
+            int count_den = den;
             while (count_den > 0)
             {
-                short left = count_num - count_den;
-                unsigned short partial;
+                int left = count_num - count_den;
+                int partial;
                 if (left <= 0)
                 {
                     partial = count_num;
@@ -260,20 +351,19 @@ static bool ResizeHorizontalRGB(const VSFrameRef* src, VSFrameRef* dst, const T*
 }
 
 template <typename T>
-static bool ResizeVerticalRGB(const VSFrameRef* src, VSFrameRef* dst, const T* srcp, T* VS_RESTRICT dstp,
-    int src_stride, int dst_stride, const AreaData* const VS_RESTRICT d, const VSAPI* vsapi) noexcept
+static bool ResizeVerticalRGB(const T* srcp, T* VS_RESTRICT dstp,
+    int src_stride, int dst_stride, const AreaData* const VS_RESTRICT d, const AreaPlan* plan) noexcept
 {
-    int gcd_v = gcd(vsapi->getFrameHeight(src, 0), vsapi->getFrameHeight(dst, 0));
-    int num = vsapi->getFrameHeight(dst, 0) / gcd_v;
-    int den = vsapi->getFrameHeight(src, 0) / gcd_v;
+    int num = plan->num_v[0];
+    int den = plan->den_v[0];
 
-    int dst_height = vsapi->getFrameHeight(dst, 0);
-    int dst_width = vsapi->getFrameWidth(dst, 0);
+    int dst_height = d->target_height;
+    int dst_width = d->target_width;
 
     double scale;
-    if (d->vi->format->bytesPerSample == 1)
+    if (d->vi->format.bytesPerSample == 1)
         scale = 100.0;
-    else if (d->vi->format->bytesPerSample == 2)
+    else if (d->vi->format.bytesPerSample == 2)
         scale = 1.0;
 
     double invert_den_hun = scale / (double)den;
@@ -288,18 +378,18 @@ static bool ResizeVerticalRGB(const VSFrameRef* src, VSFrameRef* dst, const T* s
         const T* curSrcp = srcp + curPixel * ps;
         T* curDstp = dstp + curPixel * ps;
 
-        unsigned short count_num = num;
+        int count_num = num;
         int index_src = 0;
         for (int index_value = dst_height; index_value--; )
         {
             double blue = 0.0;
             double green = 0.0;
             double red = 0.0;
-            unsigned short count_den = den;
+            int count_den = den;
             while (count_den > 0)
             {
-                short left = count_num - count_den;
-                unsigned short partial;
+                int left = count_num - count_den;
+                int partial;
                 if (left <= 0)
                 {
                     partial = count_num;
@@ -342,16 +432,15 @@ static bool ResizeVerticalRGB(const VSFrameRef* src, VSFrameRef* dst, const T* s
 }
 
 template <>
-bool ResizeHorizontalRGB(const VSFrameRef* src, VSFrameRef* dst, const float* srcp, float* VS_RESTRICT dstp,
-    int src_stride, int dst_stride, const AreaData* const VS_RESTRICT d, const VSAPI* vsapi) noexcept
+bool ResizeHorizontalRGB(const float* srcp, float* VS_RESTRICT dstp,
+    int src_stride, int dst_stride, const AreaData* const VS_RESTRICT d, const AreaPlan* plan) noexcept
 {
-    int gcd_h = gcd(vsapi->getFrameWidth(src, 0), vsapi->getFrameWidth(dst, 0));
-    int num = vsapi->getFrameWidth(dst, 0) / gcd_h;
-    int den = vsapi->getFrameWidth(src, 0) / gcd_h;
+    int num = plan->num_h[0];
+    int den = plan->den_h[0];
     double invert_den_hun = 1.0 / (double)den;
 
-    int src_height = vsapi->getFrameHeight(src, 0);
-    int dst_width = vsapi->getFrameWidth(dst, 0);
+    int src_height = plan->src_height;
+    int dst_width = d->target_width;
 
     const int ps = 3;
 #if defined(_MSC_VER)
@@ -363,18 +452,18 @@ bool ResizeHorizontalRGB(const VSFrameRef* src, VSFrameRef* dst, const float* sr
         const float* curSrcp = srcp + (src_stride * curPixel * ps);
         float* curBuff = dstp + (dst_width * curPixel * ps);
 
-        unsigned short count_num = num;
+        int count_num = num;
         int index_src = 0;
         for (unsigned int index_value = dst_width; index_value--; )
         {
             double blue = 0.0;
             double green = 0.0;
             double red = 0.0;
-            unsigned short count_den = den;
+            int count_den = den;
             while (count_den > 0)
             {
-                short left = count_num - count_den;
-                unsigned short partial;
+                int left = count_num - count_den;
+                int partial;
                 if (left <= 0)
                 {
                     partial = count_num;
@@ -417,16 +506,15 @@ bool ResizeHorizontalRGB(const VSFrameRef* src, VSFrameRef* dst, const float* sr
 }
 
 template <>
-bool ResizeVerticalRGB(const VSFrameRef* src, VSFrameRef* dst, const float* srcp, float* VS_RESTRICT dstp,
-    int src_stride, int dst_stride, const AreaData* const VS_RESTRICT d, const VSAPI* vsapi) noexcept
+bool ResizeVerticalRGB(const float* srcp, float* VS_RESTRICT dstp,
+    int src_stride, int dst_stride, const AreaData* const VS_RESTRICT d, const AreaPlan* plan) noexcept
 {
-    int gcd_v = gcd(vsapi->getFrameHeight(src, 0), vsapi->getFrameHeight(dst, 0));
-    int num = vsapi->getFrameHeight(dst, 0) / gcd_v;
-    int den = vsapi->getFrameHeight(src, 0) / gcd_v;
+    int num = plan->num_v[0];
+    int den = plan->den_v[0];
     double invert_den_hun = 1.0 / (double)den;
 
-    int dst_height = vsapi->getFrameHeight(dst, 0);
-    int dst_width = vsapi->getFrameWidth(dst, 0);
+    int dst_height = d->target_height;
+    int dst_width = d->target_width;
 
     const int ps = 3;
 #if defined(_MSC_VER)
@@ -438,18 +526,18 @@ bool ResizeVerticalRGB(const VSFrameRef* src, VSFrameRef* dst, const float* srcp
         const float* curSrcp = srcp + curPixel * ps;
         float* curDstp = dstp + curPixel * ps;
 
-        unsigned short count_num = num;
+        int count_num = num;
         int index_src = 0;
         for (int index_value = dst_height; index_value--; )
         {
             double blue = 0.0;
             double green = 0.0;
             double red = 0.0;
-            unsigned short count_den = den;
+            int count_den = den;
             while (count_den > 0)
             {
-                short left = count_num - count_den;
-                unsigned short partial;
+                int left = count_num - count_den;
+                int partial;
                 if (left <= 0)
                 {
                     partial = count_num;
@@ -491,63 +579,305 @@ bool ResizeVerticalRGB(const VSFrameRef* src, VSFrameRef* dst, const float* srcp
     return true;
 }
 
+// Linear light conversion of one sample, as done by the RGB kernels. Float RGB has
+// no gamma correction.
+template <typename T>
+static inline double LinearValue(const AreaData* const VS_RESTRICT d, T value) noexcept
+{
+    return d->linear_LUT[int(value)];
+}
+
+template <>
+inline double LinearValue(const AreaData* const VS_RESTRICT d, float value) noexcept
+{
+    return value;
+}
+
+// Gamma encoding of a linear light average for the YUV output. Truncating the average
+// to a gamma_LUT index would quantize it again in linear light, so it is interpolated
+// between entries. Near black, and at the last entry, the curve is computed directly.
+template <typename T>
+static inline double GammaValue(const AreaData* const VS_RESTRICT d, double linear) noexcept
+{
+    const int peak = (1 << d->vi->format.bitsPerSample) - 1;
+    const double pos = linear * (sizeof(T) == 1 ? 100.0 : 1.0);
+    const int index = (int)pos;
+    const int last = sizeof(T) == 1 ? RGB_PIXEL_RANGE_EXTENDED - 1 : peak;
+
+    if (index < GAMMA_INTERPOLATION_MIN || index >= last)
+        return std::pow(std::max(linear, 0.0) / peak, 1.0 / d->gamma) * peak;
+
+    return d->gamma_LUT[index] + (d->gamma_LUT[index + 1] - d->gamma_LUT[index]) * (pos - index);
+}
+
+template <>
+inline double GammaValue<float>(const AreaData* const VS_RESTRICT d, double linear) noexcept
+{
+    return linear;
+}
+
+// Same as ResizeVerticalRGB, but keeps the linear light averages unquantized for the
+// YUV output, instead of gamma encoding them back to T. Only rows [dst_y, dst_y + dst_height)
+// are written, packed from dstp. srcp points to the source row containing the top of dst_y.
+template <typename T>
+static bool ResizeVerticalRGBLinear(const T* srcp, double* VS_RESTRICT dstp, int src_stride,
+    int dst_y, int dst_height, const AreaData* const VS_RESTRICT d, const AreaPlan* plan) noexcept
+{
+    int num = plan->num_v[0];
+    int den = plan->den_v[0];
+    double invert_den = 1.0 / (double)den;
+
+    int dst_width = d->target_width;
+
+    const int start_num = num - (int)((int64_t)dst_y * den % num);
+
+    const int ps = 3;
+    for (int curPixel = 0; curPixel < dst_width; curPixel++)
+    {
+        const T* curSrcp = srcp + curPixel * ps;
+        double* curDstp = dstp + curPixel * ps;
+
+        int count_num = start_num;
+        int index_src = 0;
+        for (int index_value = dst_height; index_value--; )
+        {
+            double blue = 0.0;
+            double green = 0.0;
+            double red = 0.0;
+            int count_den = den;
+            while (count_den > 0)
+            {
+                int left = count_num - count_den;
+                int partial;
+                if (left <= 0)
+                {
+                    partial = count_num;
+                    count_den = (int)abs(left);
+                    count_num = num;
+                }
+                else
+                {
+                    count_num = left;
+                    partial = count_den;
+                    count_den = 0;
+                }
+
+                blue += LinearValue<T>(d, curSrcp[index_src]) * partial;
+                green += LinearValue<T>(d, curSrcp[index_src + 1]) * partial;
+                red += LinearValue<T>(d, curSrcp[index_src + 2]) * partial;
+
+                if (left <= 0)
+                    index_src += src_stride * ps;
+            }
+
+            const int index = (dst_height - index_value - 1) * dst_width * ps;
+
+            curDstp[index] = blue * invert_den;
+            curDstp[index + 1] = green * invert_den;
+            curDstp[index + 2] = red * invert_den;
+        }
+    }
+
+    return true;
+}
+
+// Run the vertical pass for YUV output and convert to YUV, one strip of
+// (1 << subSamplingH) output rows at a time, so the linear light averages only need a
+// strip sized buffer. Luma is written per pixel. Chroma is averaged in linear light
+// over each (1 << subSamplingW) x (1 << subSamplingH) block, like luma is averaged over
+// the source, and only then gamma encoded. Each output sample is rounded once.
+// srcp is the packed result of the horizontal pass. Returns false if the strip buffer
+// can't be allocated.
 template <typename T>
-static void process(const VSFrameRef* src, VSFrameRef* dst, VSFrameRef* buf,
-    const AreaData* const VS_RESTRICT d, const VSAPI* vsapi) noexcept
+static bool StoreYUVFromRGB(const T* srcp, VSFrame* dst,
+    const AreaData* const VS_RESTRICT d, const AreaPlan* plan, const VSAPI* vsapi) noexcept
 {
-    switch (d->vi->format->colorFamily)
+    const VSVideoFormat* fo = &d->out_format;
+    const int ssw = fo->subSamplingW;
+    const int ssh = fo->subSamplingH;
+
+    const double kr = d->kr;
+    const double kb = d->kb;
+    const double kg = 1.0 - kr - kb;
+    const double cb_div = 2.0 * (1.0 - kb);
+    const double cr_div = 2.0 * (1.0 - kr);
+
+    // integer output is limited range, float output is Y in [0, 1] and UV in [-0.5, 0.5]
+    double y_scale = 1.0, y_offset = 0.0, c_scale = 1.0, c_offset = 0.0, round = 0.0;
+    if (fo->sampleType == stInteger)
     {
-        case cmYUV:
+        const int shift = fo->bitsPerSample - 8;
+        const double peak = (double)((1 << fo->bitsPerSample) - 1);
+        y_scale = (double)(219 << shift) / peak;
+        y_offset = (double)(16 << shift);
+        c_scale = (double)(224 << shift) / peak;
+        c_offset = (double)(128 << shift);
+        round = 0.5;
+    }
+
+    const int num = plan->num_v[0];
+    const int den = plan->den_v[0];
+    const int target_width = d->target_width;
+    const int ps = 3;
+
+    T* VS_RESTRICT dstpY = reinterpret_cast<T*>(vsapi->getWritePtr(dst, 0));
+    T* VS_RESTRICT dstpU = reinterpret_cast<T*>(vsapi->getWritePtr(dst, 1));
+    T* VS_RESTRICT dstpV = reinterpret_cast<T*>(vsapi->getWritePtr(dst, 2));
+    const int stride_y = vsapi->getStride(dst, 0) / sizeof(T);
+    const int stride_uv = vsapi->getStride(dst, 1) / sizeof(T);
+
+    const int chroma_width = vsapi->getFrameWidth(dst, 1);
+    const int chroma_height = vsapi->getFrameHeight(dst, 1);
+    const int block_w = 1 << ssw;
+    const int block_h = 1 << ssh;
+    const double invert_area = 1.0 / (double)(block_w * block_h);
+
+    const size_t strip_size = (size_t)target_width * block_h * ps;
+
+    auto store_strip = [&](int y, double* strip)
+    {
+        const int dst_y = y << ssh;
+        const int src_y = (int)((int64_t)dst_y * den / num);
+
+        ResizeVerticalRGBLinear<T>(srcp + (size_t)src_y * target_width * ps, strip, target_width, dst_y, block_h, d, plan);
+
+        for (int by = 0; by < block_h; by++)
         {
-            for (int plane = 0; plane < d->vi->format->numPlanes; plane++)
+            const double* curStrip = strip + by * target_width * ps;
+            T* curDstpY = dstpY + (dst_y + by) * stride_y;
+            for (int x = 0; x < target_width; x++)
             {
+                const double blue = GammaValue<T>(d, curStrip[x * ps]);
+                const double green = GammaValue<T>(d, curStrip[x * ps + 1]);
+                const double red = GammaValue<T>(d, curStrip[x * ps + 2]);
+                const double luma = kr * red + kg * green + kb * blue;
+                curDstpY[x] = (T)(luma * y_scale + y_offset + round);
+            }
+        }
+
+        T* curDstpU = dstpU + y * stride_uv;
+        T* curDstpV = dstpV + y * stride_uv;
+        for (int x = 0; x < chroma_width; x++)
+        {
+            double blue = 0.0;
+            double green = 0.0;
+            double red = 0.0;
+            for (int by = 0; by < block_h; by++)
+            {
+                const double* blockp = strip + (by * target_width + (x << ssw)) * ps;
+                for (int bx = 0; bx < block_w; bx++)
+                {
+                    blue += blockp[bx * ps];
+                    green += blockp[bx * ps + 1];
+                    red += blockp[bx * ps + 2];
+                }
+            }
+            blue = GammaValue<T>(d, blue * invert_area);
+            green = GammaValue<T>(d, green * invert_area);
+            red = GammaValue<T>(d, red * invert_area);
+
+            const double luma = kr * red + kg * green + kb * blue;
+            curDstpU[x] = (T)((blue - luma) / cb_div * c_scale + c_offset + round);
+            curDstpV[x] = (T)((red - luma) / cr_div * c_scale + c_offset + round);
+        }
+    };
+
+#if defined(_MSC_VER)
+    // one strip buffer per worker thread, reused by every strip it runs
+    Concurrency::combinable<double*> strips([]() -> double* { return nullptr; });
+    std::atomic<bool> allocated{ true };
+
+    Concurrency::parallel_for(0, chroma_height, [&](int y)
+    {
+        double*& strip = strips.local();
+        if (!strip)
+            strip = new (std::nothrow) double[strip_size];
+
+        if (strip)
+            store_strip(y, strip);
+        else
+            allocated = false;
+    });
+
+    strips.combine_each([](double* strip) { delete[] strip; });
+
+    if (!allocated)
+        return false;
+#else
+    double* strip = new (std::nothrow) double[strip_size];
+    if (!strip)
+        return false;
+
+    for (int y = 0; y < chroma_height; y++)
+        store_strip(y, strip);
+
+    delete[] strip;
+#endif
+
+    VSMap* props = vsapi->getFramePropertiesRW(dst);
+    vsapi->mapSetInt(props, "_Matrix", d->matrix, maReplace);
+    vsapi->mapSetInt(props, "_ColorRange", fo->sampleType == stInteger ? 1 : 0, maReplace);
+
+    // a box average over the block is sited at its center
+    if (ssw > 0 || ssh > 0)
+        vsapi->mapSetInt(props, "_ChromaLocation", 1, maReplace);
+
+    return true;
+}
+
+// For RGB, src is released and set to null once it is copied into the interleaved
+// buffer, so the source frame isn't kept alive through both passes. Gray and YUV read
+// src until the end, and the caller releases it. Returns false if a buffer can't be allocated.
+template <typename T>
+static bool process(const VSFrame*& src, VSFrame* dst,
+    const AreaData* const VS_RESTRICT d, const AreaPlan* plan, const VSAPI* vsapi) noexcept
+{
+    switch (d->vi->format.colorFamily)
+    {
+        case cfYUV:
+        case cfGray:
+        {
+            for (int plane = 0; plane < d->vi->format.numPlanes; plane++)
+            {
+                // skipped planes are already referenced from src by AreaGetFrame
+                if (!plan->process_plane[plane])
+                    continue;
+
                 const T* srcp = reinterpret_cast<const T*>(vsapi->getReadPtr(src, plane));
                 T* VS_RESTRICT dstp = reinterpret_cast<T*>(vsapi->getWritePtr(dst, plane));
-                T* VS_RESTRICT buff = reinterpret_cast<T*>(vsapi->getWritePtr(buf, plane));
                 int src_stride = vsapi->getStride(src, plane) / sizeof(T);
                 int dst_stride = vsapi->getStride(dst, plane) / sizeof(T);
-                int buf_stride = vsapi->getStride(buf, plane) / sizeof(T);
 
-                ResizeHorizontalPlanar<T>(src, dst, srcp, buff, src_stride, buf_stride, plane, vsapi);
-                ResizeVerticalPlanar<T>(src, dst, (const T*)buff, dstp, buf_stride, dst_stride, plane, vsapi);
+                if (!ResizePlanarTiled<T>(srcp, dstp, src_stride, dst_stride,
+                    vsapi->getFrameWidth(dst, plane), vsapi->getFrameHeight(dst, plane), plane, plan))
+                    return false;
             }
-            
-            break;
-        }
-            
-        case cmGray:
-        {
-            const T* srcp = reinterpret_cast<const T*>(vsapi->getReadPtr(src, 0));
-            T* VS_RESTRICT dstp = reinterpret_cast<T*>(vsapi->getWritePtr(dst, 0));
-            T* VS_RESTRICT buff = reinterpret_cast<T*>(vsapi->getWritePtr(buf, 0));
-            int src_stride = vsapi->getStride(src, 0) / sizeof(T);
-            int dst_stride = vsapi->getStride(dst, 0) / sizeof(T);
-            int buf_stride = vsapi->getStride(buf, 0) / sizeof(T);
 
-            ResizeHorizontalPlanar<T>(src, dst, srcp, buff, src_stride, buf_stride, 0, vsapi);
-            ResizeVerticalPlanar<T>(src, dst, (const T*)buff, dstp, buf_stride, dst_stride, 0, vsapi);
-            
             break;
         }
 
-        case cmRGB:
+        case cfRGB:
         {
             const T* srcpR = reinterpret_cast<const T*>(vsapi->getReadPtr(src, 0));
             const T* srcpG = reinterpret_cast<const T*>(vsapi->getReadPtr(src, 1));
             const T* srcpB = reinterpret_cast<const T*>(vsapi->getReadPtr(src, 2));
             int src_stride = vsapi->getStride(src, 0) / sizeof(T);
-            int buf_stride = vsapi->getStride(buf, 0) / sizeof(T);
             int dst_stride = vsapi->getStride(dst, 0) / sizeof(T);
 
+            int src_width = plan->src_width;
+            int src_height = plan->src_height;
+
             // Interleaved
-            T* srcInterleaved = new (std::nothrow) T[d->vi->width * d->vi->height * 3];
-            T* dstInterleaved = new (std::nothrow) T[d->target_width * d->target_height * 3];
-            T* bufInterleaved = new (std::nothrow) T[d->target_width * d->vi->height * 3];
+            T* srcInterleaved = new (std::nothrow) T[src_width * src_height * 3];
+            T* bufInterleaved = new (std::nothrow) T[d->target_width * src_height * 3];
+            if (!srcInterleaved || !bufInterleaved)
+            {
+                delete[] srcInterleaved;
+                delete[] bufInterleaved;
+                return false;
+            }
 
             // change to Interleaved
-            int src_width = vsapi->getFrameWidth(src, 0);
-            int src_height = vsapi->getFrameHeight(src, 0);
-
             for (int y = 0; y < src_height; y++)
             {
                 for (int x = 0; x < src_width; x++)
@@ -562,53 +892,140 @@ static void process(const VSFrameRef* src, VSFrameRef* dst, VSFrameRef* buf,
                 srcpR += src_stride;
             }
 
-            ResizeHorizontalRGB<T>(src, dst, (const T*)srcInterleaved, bufInterleaved, src_stride, buf_stride, d, vsapi);
-            ResizeVerticalRGB<T>(src, dst, (const T*)bufInterleaved, dstInterleaved, buf_stride, dst_stride, d, vsapi);
+            vsapi->freeFrame(src);
+            src = nullptr;
 
-            T* VS_RESTRICT dstpR = reinterpret_cast<T*>(vsapi->getWritePtr(dst, 0));
-            T* VS_RESTRICT dstpG = reinterpret_cast<T*>(vsapi->getWritePtr(dst, 1));
-            T* VS_RESTRICT dstpB = reinterpret_cast<T*>(vsapi->getWritePtr(dst, 2));
+            // interleaved buffers are packed, so their row pitch is the width in pixels
+            ResizeHorizontalRGB<T>((const T*)srcInterleaved, bufInterleaved, src_width, d->target_width, d, plan);
+            delete[] srcInterleaved;
 
-            //change back from Interleaved
-            int target_height = d->target_height;
-            int target_width = d->target_width;
+            if (d->out_format.colorFamily == cfYUV)
+            {
+                // matrix and chroma subsampling are fused into the final pass, from the
+                // linear light averages before they are quantized
+                const bool stored = StoreYUVFromRGB<T>((const T*)bufInterleaved, dst, d, plan, vsapi);
+                delete[] bufInterleaved;
 
-            for (int y = 0; y < target_height; y++)
+                if (!stored)
+                    return false;
+            }
+            else
             {
-                for (int x = 0; x < target_width; x++)
+                // allocated only now, so the source and output buffers are never alive together
+                T* dstInterleaved = new (std::nothrow) T[d->target_width * d->target_height * 3];
+                if (!dstInterleaved)
                 {
-                    const unsigned pos = (x + y * target_width) * 3;
-                    dstpB[x] = dstInterleaved[pos];
-                    dstpG[x] = dstInterleaved[pos + 1];
-                    dstpR[x] = dstInterleaved[pos + 2];
+                    delete[] bufInterleaved;
+                    return false;
                 }
-                dstpB += dst_stride;
-                dstpG += dst_stride;
-                dstpR += dst_stride;
-            }
 
-            delete[] srcInterleaved;
-            delete[] bufInterleaved;
-            delete[] dstInterleaved;
+                ResizeVerticalRGB<T>((const T*)bufInterleaved, dstInterleaved, d->target_width, d->target_width, d, plan);
+                delete[] bufInterleaved;
+
+                T* VS_RESTRICT dstpR = reinterpret_cast<T*>(vsapi->getWritePtr(dst, 0));
+                T* VS_RESTRICT dstpG = reinterpret_cast<T*>(vsapi->getWritePtr(dst, 1));
+                T* VS_RESTRICT dstpB = reinterpret_cast<T*>(vsapi->getWritePtr(dst, 2));
+
+                //change back from Interleaved
+                int target_height = d->target_height;
+                int target_width = d->target_width;
+
+                for (int y = 0; y < target_height; y++)
+                {
+                    for (int x = 0; x < target_width; x++)
+                    {
+                        const unsigned pos = (x + y * target_width) * 3;
+                        dstpB[x] = dstInterleaved[pos];
+                        dstpG[x] = dstInterleaved[pos + 1];
+                        dstpR[x] = dstInterleaved[pos + 2];
+                    }
+                    dstpB += dst_stride;
+                    dstpG += dst_stride;
+                    dstpR += dst_stride;
+                }
+
+                delete[] dstInterleaved;
+            }
 
             break;
         }
     }
+
+    return true;
 }
 
-static void VS_CC AreaInit(VSMap* in, VSMap* out, void** instanceData, VSNode* node, VSCore* core, const VSAPI* vsapi)
+static std::shared_ptr<const AreaPlan> MakePlan(const AreaData* const VS_RESTRICT d, int src_width, int src_height)
 {
-    AreaData* d = static_cast<AreaData*>(*instanceData);
-    VSVideoInfo dst_vi = (VSVideoInfo) * (d->vi);
-    dst_vi.width = d->target_width;
-    dst_vi.height = d->target_height;
-    vsapi->setVideoInfo(&dst_vi, 1, node);
+    if (src_width < d->target_width || src_height < d->target_height)
+        throw std::string{ "This filter is only for downscale." };
+
+    auto plan = std::make_shared<AreaPlan>();
+    plan->src_width = src_width;
+    plan->src_height = src_height;
+
+    const VSVideoFormat* fi = &d->vi->format;
+    const VSVideoFormat* fo = &d->out_format;
+    for (int plane = 0; plane < fi->numPlanes; plane++)
+    {
+        const int src_plane_width = src_width >> (plane ? fi->subSamplingW : 0);
+        const int src_plane_height = src_height >> (plane ? fi->subSamplingH : 0);
+        // RGB is resized from interleaved planes, so every plane uses the luma size
+        const int dst_plane_width = d->target_width >> (plane && fi->colorFamily != cfRGB ? fo->subSamplingW : 0);
+        const int dst_plane_height = d->target_height >> (plane && fi->colorFamily != cfRGB ? fo->subSamplingH : 0);
+
+        int gcd_h = gcd(src_plane_width, dst_plane_width);
+        plan->num_h[plane] = dst_plane_width / gcd_h;
+        plan->den_h[plane] = src_plane_width / gcd_h;
+
+        int gcd_v = gcd(src_plane_height, dst_plane_height);
+        plan->num_v[plane] = dst_plane_height / gcd_v;
+        plan->den_v[plane] = src_plane_height / gcd_v;
+
+        // a plane whose size doesn't change is an identity resize, so pass it through
+        plan->process_plane[plane] = fi->colorFamily == cfRGB ||
+            src_plane_width != dst_plane_width || src_plane_height != dst_plane_height;
+
+        // square source blocks of about half the cache budget; the intermediate buffer is
+        // never larger than the source block, since this filter only downscales
+        const int src_tile = std::max(1, (int)std::sqrt((double)TILE_CACHE_BYTES / (2 * fi->bytesPerSample)));
+        plan->tile_width[plane] = std::min(dst_plane_width, std::max(1, src_tile * plan->num_h[plane] / plan->den_h[plane]));
+        plan->tile_height[plane] = std::min(dst_plane_height, std::max(1, src_tile * plan->num_v[plane] / plan->den_v[plane]));
+    }
+
+    return plan;
 }
 
-static const VSFrameRef* VS_CC AreaGetFrame(int n, int activationReason, void** instanceData, void** frameData,
+static std::shared_ptr<const AreaPlan> GetPlan(const AreaData* const VS_RESTRICT d, int src_width, int src_height)
+{
+    std::lock_guard<std::mutex> lock(d->plan_mutex);
+
+    const uint64_t now = ++d->plan_clock;
+
+    auto it = d->plans.find(std::make_pair(src_width, src_height));
+    if (it != d->plans.end())
+    {
+        it->second.last_use = now;
+        return it->second.plan;
+    }
+
+    std::shared_ptr<const AreaPlan> plan = MakePlan(d, src_width, src_height);
+
+    // frames in flight hold their own reference, so the least recently used entry can be dropped
+    if (d->plans.size() >= MAX_CACHED_PLANS)
+    {
+        auto oldest = std::min_element(d->plans.begin(), d->plans.end(),
+            [](const auto& a, const auto& b) { return a.second.last_use < b.second.last_use; });
+        d->plans.erase(oldest);
+    }
+
+    d->plans.emplace(std::make_pair(src_width, src_height), CachedPlan{ plan, now });
+    return plan;
+}
+
+static const VSFrame* VS_CC AreaGetFrame(int n, int activationReason, void* instanceData, void** frameData,
     VSFrameContext* frameCtx, VSCore* core, const VSAPI* vsapi)
 {
-    const AreaData* d = static_cast<const AreaData*>(*instanceData);
+    const AreaData* d = static_cast<const AreaData*>(instanceData);
 
     if (activationReason == arInitial)
     {
@@ -616,20 +1033,75 @@ static const VSFrameRef* VS_CC AreaGetFrame(int n, int activationReason, void**
     }
     else if (activationReason == arAllFramesReady)
     {
-        const VSFrameRef* src = vsapi->getFrameFilter(n, d->node, frameCtx);
-        const VSFormat* fi = d->vi->format;
-        VSFrameRef* dst = vsapi->newVideoFrame(fi, d->target_width, d->target_height, src, core);
-        VSFrameRef* buf = vsapi->newVideoFrame(fi, d->target_width, d->vi->height, src, core);
+        const VSFrame* src = vsapi->getFrameFilter(n, d->node, frameCtx);
+        const VSVideoFormat* fi = &d->vi->format;
 
+        std::shared_ptr<const AreaPlan> plan;
+        try
+        {
+            plan = GetPlan(d, vsapi->getFrameWidth(src, 0), vsapi->getFrameHeight(src, 0));
+        }
+        catch (const std::string& error)
+        {
+            vsapi->setFilterError(("AreaResize: " + error).c_str(), frameCtx);
+            vsapi->freeFrame(src);
+            return nullptr;
+        }
+        catch (const std::exception& error)
+        {
+            // e.g. std::bad_alloc from a new cache entry, which must not escape into the core
+            vsapi->setFilterError((std::string{ "AreaResize: " } + error.what()).c_str(), frameCtx);
+            vsapi->freeFrame(src);
+            return nullptr;
+        }
+
+        // planes that are not processed are passed through by reference
+        const VSFrame* plane_src[3] = { nullptr, nullptr, nullptr };
+        const int planes[3] = { 0, 1, 2 };
+        if (fi->colorFamily != cfRGB)
+        {
+            for (int plane = 0; plane < fi->numPlanes; plane++)
+                plane_src[plane] = plan->process_plane[plane] ? nullptr : src;
+        }
+
+        VSFrame* dst = vsapi->newVideoFrame2(&d->out_format, d->target_width, d->target_height, plane_src, planes, src, core);
+
+        // area averaged chroma is sited at the center of its block. With only vertical
+        // subsampling added, the horizontal siting (left or center) of src is kept
+        if (fi->colorFamily == cfYUV &&
+            (d->out_format.subSamplingW != fi->subSamplingW || d->out_format.subSamplingH != fi->subSamplingH))
+        {
+            VSMap* props = vsapi->getFramePropertiesRW(dst);
+            int location = 1;
+
+            if (d->out_format.subSamplingW == fi->subSamplingW)
+            {
+                int err;
+                const int src_location = vsh::int64ToIntS(vsapi->mapGetInt(props, "_ChromaLocation", 0, &err));
+                location = (err || src_location % 2 == 0) ? 0 : 1;
+            }
+
+            vsapi->mapSetInt(props, "_ChromaLocation", location, maReplace);
+        }
+
+        bool processed;
         if (fi->bytesPerSample == 1)
-            process<uint8_t>(src, dst, buf, d, vsapi);
+            processed = process<uint8_t>(src, dst, d, plan.get(), vsapi);
         else if (fi->bytesPerSample == 2)
-            process<uint16_t>(src, dst, buf, d, vsapi);
+            processed = process<uint16_t>(src, dst, d, plan.get(), vsapi);
         else
-            process<float>(src, dst, buf, d, vsapi);
+            processed = process<float>(src, dst, d, plan.get(), vsapi);
 
+        // null if process already released it
         vsapi->freeFrame(src);
-        vsapi->freeFrame(buf);
+
+        if (!processed)
+        {
+            vsapi->setFilterError("AreaResize: Failed to allocate an intermediate buffer.", frameCtx);
+            vsapi->freeFrame(dst);
+            return nullptr;
+        }
+
         return dst;
     }
 
@@ -641,7 +1113,7 @@ static void VS_CC AreaFree(void* instanceData, VSCore* core, const VSAPI* vsapi)
     AreaData* d = static_cast<AreaData*>(instanceData);
     vsapi->freeNode(d->node);
 
-    if (d->vi->format->colorFamily == cmRGB && d->vi->format->bytesPerSample <= 2)
+    if (d->vi->format.colorFamily == cfRGB && d->vi->format.bytesPerSample <= 2)
     {
         delete[] d->linear_LUT;
         delete[] d->gamma_LUT;
@@ -655,51 +1127,115 @@ static void VS_CC AreaCreate(const VSMap* in, VSMap* out, void* userData, VSCore
     std::unique_ptr<AreaData> d = std::make_unique<AreaData>();
     int err;
 
-    d->node = vsapi->propGetNode(in, "clip", 0, nullptr);
+    d->node = vsapi->mapGetNode(in, "clip", 0, nullptr);
     d->vi = vsapi->getVideoInfo(d->node);
 
-    d->target_width = int64ToIntS(vsapi->propGetInt(in, "width", 0, &err));
-    d->target_height = int64ToIntS(vsapi->propGetInt(in, "height", 0, &err));
+    d->target_width = vsh::int64ToIntS(vsapi->mapGetInt(in, "width", 0, &err));
+    if (err)
+        d->target_width = d->vi->width;
+
+    d->target_height = vsh::int64ToIntS(vsapi->mapGetInt(in, "height", 0, &err));
+    if (err)
+        d->target_height = d->vi->height;
 
-    double gamma = vsapi->propGetFloat(in, "gamma", 0, &err);
+    double gamma = vsapi->mapGetFloat(in, "gamma", 0, &err);
     if (err)
         gamma = 2.2;
+    d->gamma = gamma;
+
+    d->out_format = d->vi->format;
+    int64_t format_id = vsapi->mapGetInt(in, "format", 0, &err);
+    bool valid_format = err || vsapi->getVideoFormatByID(&d->out_format, (uint32_t)format_id, core);
+
+    d->matrix = vsh::int64ToIntS(vsapi->mapGetInt(in, "matrix", 0, &err));
+    if (err)
+        d->matrix = 1;
 
     try
     {
-        if (!isConstantFormat(d->vi) ||
-            (d->vi->format->sampleType == stInteger && d->vi->format->bitsPerSample > 16) ||
-            (d->vi->format->sampleType == stFloat && d->vi->format->bitsPerSample != 32))
+        if (d->vi->format.colorFamily == cfUndefined ||
+            (d->vi->format.sampleType == stInteger && d->vi->format.bitsPerSample > 16) ||
+            (d->vi->format.sampleType == stFloat && d->vi->format.bitsPerSample != 32))
             throw std::string{ "Only constant format 8-16 bits integer and 32 bits float input supported." };
 
+        if (!vsh::isConstantVideoFormat(d->vi) && (d->target_width == 0 || d->target_height == 0))
+            throw std::string{ "Target width and height must be given for variable resolution input." };
+
         if (d->target_width < 1 || d->target_height < 1)
             throw std::string{ "Target width and height must be 1 or higher." };
 
         if (d->target_width & 1 || d->target_height & 1)
             throw std::string{ "Target width and height requires mod 2." };
 
-        if (d->vi->width < d->target_width || d->vi->height < d->target_height)
-            throw std::string{ "This filter is only for downscale." };
-
-        if (d->vi->format->colorFamily != cmRGB && d->vi->format->sampleType == stInteger && d->target_width % 32)
-            throw std::string{ "For 8-16 bits Gray or YUV format, target width must be divisible by 32." };
-
         if (gamma <= 0)
             throw std::string{ "Gamma must be greater than 0." };
+
+        if (!valid_format)
+            throw std::string{ "Invalid output format." };
+
+        if (!vsh::isSameVideoFormat(&d->out_format, &d->vi->format))
+        {
+            if (d->out_format.colorFamily != cfYUV ||
+                (d->vi->format.colorFamily != cfRGB && d->vi->format.colorFamily != cfYUV))
+                throw std::string{ "Output format conversion is only supported from RGB or YUV to YUV." };
+
+            if (d->out_format.sampleType != d->vi->format.sampleType ||
+                d->out_format.bitsPerSample != d->vi->format.bitsPerSample)
+                throw std::string{ "Output format must have the same sample type and bit depth as input." };
+
+            if (d->vi->format.colorFamily == cfRGB &&
+                (d->out_format.subSamplingW > 1 || d->out_format.subSamplingH > d->out_format.subSamplingW))
+                throw std::string{ "Only 4:4:4, 4:2:2 and 4:2:0 output is supported for RGB input." };
+
+            if (d->vi->format.colorFamily == cfYUV &&
+                (d->out_format.subSamplingW < d->vi->format.subSamplingW ||
+                 d->out_format.subSamplingH < d->vi->format.subSamplingH))
+                throw std::string{ "Output chroma subsampling must not be lower than input." };
+
+            if (d->target_width % (1 << d->out_format.subSamplingW) || d->target_height % (1 << d->out_format.subSamplingH))
+                throw std::string{ "Target width and height must be divisible by the output chroma subsampling." };
+        }
+
+        // BT.709 and BT.2020 non-constant luminance, only used for RGB to YUV
+        if (d->vi->format.colorFamily == cfRGB && d->out_format.colorFamily == cfYUV)
+        {
+            if (d->matrix == 1)
+            {
+                d->kr = 0.2126;
+                d->kb = 0.0722;
+            }
+            else if (d->matrix == 9)
+            {
+                d->kr = 0.2627;
+                d->kb = 0.0593;
+            }
+            else
+                throw std::string{ "Matrix must be 1 (BT.709) or 9 (BT.2020)." };
+        }
+
+        // variable resolution input is checked per frame instead
+        if (vsh::isConstantVideoFormat(d->vi))
+            GetPlan(d.get(), d->vi->width, d->vi->height);
     }
     catch (const std::string& error)
     {
-        vsapi->setError(out, ("AreaResize: " + error).c_str());
+        vsapi->mapSetError(out, ("AreaResize: " + error).c_str());
+        vsapi->freeNode(d->node);
+        return;
+    }
+    catch (const std::exception& error)
+    {
+        vsapi->mapSetError(out, (std::string{ "AreaResize: " } + error.what()).c_str());
         vsapi->freeNode(d->node);
         return;
     }
 
-    if (d->vi->format->colorFamily == cmRGB)
+    if (d->vi->format.colorFamily == cfRGB)
     {
         // for 8bit RGB
-        if (d->vi->format->bytesPerSample == 1)
+        if (d->vi->format.bytesPerSample == 1)
         {
-            int peak = (1 << d->vi->format->bitsPerSample) - 1;
+            int peak = (1 << d->vi->format.bitsPerSample) - 1;
 
             double* linear_LUT = new (std::nothrow) double[peak + 1];
             double* gamma_LUT = new (std::nothrow) double[RGB_PIXEL_RANGE_EXTENDED];
@@ -718,9 +1254,9 @@ static void VS_CC AreaCreate(const VSMap* in, VSMap* out, void* userData, VSCore
         }
 
         // for 9~16bit RGB
-        else if (d->vi->format->bytesPerSample == 2)
+        else if (d->vi->format.bytesPerSample == 2)
         {
-            int peak = (1 << d->vi->format->bitsPerSample) - 1;
+            int peak = (1 << d->vi->format.bitsPerSample) - 1;
 
             double* linear_LUT = new (std::nothrow) double[peak + 1];
             double* gamma_LUT = new (std::nothrow) double[peak + 1];
@@ -736,17 +1272,27 @@ static void VS_CC AreaCreate(const VSMap* in, VSMap* out, void* userData, VSCore
         }
     }
 
-    vsapi->createFilter(in, out, "AreaResize", AreaInit, AreaGetFrame, AreaFree, fmParallel, 0, d.release(), core);
+    VSVideoInfo dst_vi = *d->vi;
+    dst_vi.format = d->out_format;
+    dst_vi.width = d->target_width;
+    dst_vi.height = d->target_height;
+
+    // output frame n only needs source frame n, so the core can schedule and cache accordingly
+    VSFilterDependency deps[] = { { d->node, rpStrictSpatial } };
+    vsapi->createVideoFilter(out, "AreaResize", &dst_vi, AreaGetFrame, AreaFree, fmParallel, deps, 1, d.release(), core);
 }
 
-VS_EXTERNAL_API(void) VapourSynthPluginInit(VSConfigPlugin configFunc, VSRegisterFunction registerFunc, VSPlugin* plugin)
+VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin* plugin, const VSPLUGINAPI* vspapi)
 {
-    configFunc("com.vapoursynth.arearesize", "area", "area average downscaler plugin", VAPOURSYNTH_API_VERSION, 1, plugin);
-
-    registerFunc("AreaResize",
-        "clip:clip;"
-        "width:int;"
-        "height:int;"
-        "gamma:float:opt",
-        AreaCreate, 0, plugin);
+    vspapi->configPlugin("com.vapoursynth.arearesize", "area", "area average downscaler plugin", VS_MAKE_VERSION(1, 0), VAPOURSYNTH_API_VERSION, 0, plugin);
+
+    vspapi->registerFunction("AreaResize",
+        "clip:vnode;"
+        "width:int:opt;"
+        "height:int:opt;"
+        "gamma:float:opt;"
+        "format:int:opt;"
+        "matrix:int:opt;",
+        "clip:vnode;",
+        AreaCreate, nullptr, plugin);
 }